@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+
+// Toboot's versions are built with their names changed, so they can sit
+// next to the C library's.
+#define memcpy tb_memcpy
+#define memset tb_memset
+#define memcmp tb_memcmp
+#include "mem.h"
+#undef memcpy
+#undef memset
+#undef memcmp
+
+#define MAX_LEN 64
+#define SLACK 16
+
+static int failures;
+
+static void fail(const char *func, unsigned a, unsigned b, unsigned len)
+{
+    if (failures++ < 20)
+        printf("FAIL: %s, alignments %u/%u, length %u\n", func, a, b, len);
+}
+
+// A recognisable, non-repeating pattern, so that a byte copied from the
+// wrong place shows up.
+static void fill(uint8_t *p, size_t cnt, unsigned seed)
+{
+    size_t i;
+
+    for (i = 0; i < cnt; i++)
+        p[i] = (uint8_t)(i * 7 + seed * 13 + 1);
+}
+
+static int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
+static void check_memcpy(void)
+{
+    uint32_t src_buf[(MAX_LEN + 2 * SLACK) / 4];
+    uint32_t dst_buf[(MAX_LEN + 2 * SLACK) / 4];
+    uint32_t ref_buf[(MAX_LEN + 2 * SLACK) / 4];
+    unsigned s, d, len;
+
+    for (s = 0; s < 4; s++)
+        for (d = 0; d < 4; d++)
+            for (len = 0; len <= MAX_LEN; len++) {
+                uint8_t *src = (uint8_t *)src_buf + SLACK + s;
+
+                fill((uint8_t *)src_buf, sizeof(src_buf), 1);
+                fill((uint8_t *)dst_buf, sizeof(dst_buf), 2);
+                fill((uint8_t *)ref_buf, sizeof(ref_buf), 2);
+                if (tb_memcpy((uint8_t *)dst_buf + SLACK + d, src, len) != (uint8_t *)dst_buf + SLACK + d)
+                    fail("memcpy return", s, d, len);
+                memcpy((uint8_t *)ref_buf + SLACK + d, src, len);
+                if (memcmp(dst_buf, ref_buf, sizeof(dst_buf)))
+                    fail("memcpy", s, d, len);
+            }
+}
+
+static void check_memset(void)
+{
+    uint32_t dst_buf[(MAX_LEN + 2 * SLACK) / 4];
+    uint32_t ref_buf[(MAX_LEN + 2 * SLACK) / 4];
+    static const int values[] = { 0, 0xa5, 0xff, 0x1234 };
+    unsigned d, len, v;
+
+    for (v = 0; v < sizeof(values) / sizeof(values[0]); v++)
+        for (d = 0; d < 4; d++)
+            for (len = 0; len <= MAX_LEN; len++) {
+                fill((uint8_t *)dst_buf, sizeof(dst_buf), 3);
+                fill((uint8_t *)ref_buf, sizeof(ref_buf), 3);
+                if (tb_memset((uint8_t *)dst_buf + SLACK + d, values[v], len) != (uint8_t *)dst_buf + SLACK + d)
+                    fail("memset return", d, v, len);
+                memset((uint8_t *)ref_buf + SLACK + d, values[v], len);
+                if (memcmp(dst_buf, ref_buf, sizeof(dst_buf)))
+                    fail("memset", d, v, len);
+            }
+}
+
+// Every alignment and length, with the buffers equal and with a
+// difference at each position, both ways round.
+static void check_memcmp(void)
+{
+    uint32_t a_buf[(MAX_LEN + 2 * SLACK) / 4];
+    uint32_t b_buf[(MAX_LEN + 2 * SLACK) / 4];
+    unsigned a, b, len, pos;
+
+    for (a = 0; a < 4; a++)
+        for (b = 0; b < 4; b++)
+            for (len = 0; len <= MAX_LEN; len++) {
+                uint8_t *pa = (uint8_t *)a_buf + SLACK + a;
+                uint8_t *pb = (uint8_t *)b_buf + SLACK + b;
+
+                fill(pa, len, 4);
+                fill(pb, len, 4);
+                if (tb_memcmp(pa, pb, len) != 0)
+                    fail("memcmp equal", a, b, len);
+
+                for (pos = 0; pos < len; pos++) {
+                    uint8_t saved = pb[pos];
+
+                    pb[pos] = saved + 0x80;
+                    if (sign(tb_memcmp(pa, pb, len)) != sign(memcmp(pa, pb, len))
+                     || sign(tb_memcmp(pb, pa, len)) != sign(memcmp(pb, pa, len)))
+                        fail("memcmp", a, b, len);
+                    pb[pos] = saved;
+                }
+            }
+}
+
+// mem_is_blank() needs a word-aligned pointer, and can read the whole of
+// the last word, so only the length varies.
+static void check_mem_is_blank(void)
+{
+    uint32_t buf[(MAX_LEN + SLACK) / 4];
+    uint8_t *p = (uint8_t *)buf;
+    unsigned len, pos;
+
+    for (len = 0; len <= MAX_LEN; len++) {
+        memset(buf, 0xff, sizeof(buf));
+        if (!mem_is_blank(p, len))
+            fail("mem_is_blank blank", 0, 0, len);
+
+        // A programmed byte just past the end mustn't count
+        p[len] = 0xfe;
+        if (!mem_is_blank(p, len))
+            fail("mem_is_blank past end", 0, 0, len);
+
+        for (pos = 0; pos < len; pos++) {
+            memset(buf, 0xff, sizeof(buf));
+            p[pos] = 0x7f;
+            if (mem_is_blank(p, len))
+                fail("mem_is_blank", 0, pos, len);
+        }
+    }
+}
+
+static void check_mem_mismatch32(void)
+{
+    uint32_t a[MAX_LEN / 4];
+    uint32_t b[MAX_LEN / 4];
+    unsigned count, pos;
+
+    for (count = 0; count <= MAX_LEN / 4; count++) {
+        fill((uint8_t *)a, sizeof(a), 5);
+        fill((uint8_t *)b, sizeof(b), 5);
+        if (mem_mismatch32(a, b, count) != count)
+            fail("mem_mismatch32 equal", 0, 0, count);
+
+        for (pos = 0; pos < count; pos++) {
+            b[pos] ^= 0x80000000;
+            if (mem_mismatch32(a, b, count) != pos)
+                fail("mem_mismatch32", 0, pos, count);
+            b[pos] ^= 0x80000000;
+        }
+    }
+}
+
+int main(void)
+{
+    check_memcpy();
+    check_memset();
+    check_memcmp();
+    check_mem_is_blank();
+    check_mem_mismatch32();
+
+    if (failures) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -25,11 +25,20 @@
 #include "toboot-api.h"
 #include "toboot-internal.h"
 #include "mcu.h"
+#include "mem.h"
 #include "usb_dev.h"
 #include "dfu.h"
 
+// Number of status polls to wait for a word to be written.  A word takes
+// around 20 us, and each poll takes a handful of cycles at 21 MHz.
+#define FTFL_WORD_TIMEOUT 2000
+
+// DMA channel used to feed MSC->WDATA when DFU_FLASH_DMA is set.  Its
+// descriptor is the first one in the table, so it's the only one that
+// needs RAM set aside for it.
+#define FTFL_DMA_CHANNEL 0
+
 // Internal flash-programming state machine
-static unsigned fl_current_addr = 0;
 static enum {
     flsIDLE = 0,
     flsERASING,
@@ -44,14 +53,21 @@ static struct toboot_state {
     uint8_t version;
 
     // When clearing, first ensure these sectors are cleared prior to updating
-    uint32_t clear_lo;
-    uint32_t clear_hi;
+    uint32_t clear[2];
+
+    // Pages that have been erased during this download and not yet
+    // written, so they don't need erasing again when a block arrives.
+    uint32_t blank[2];
 
     // The current block we're clearing
     uint32_t clear_current;
 
-    // This is the address we'll start programming/erasing from after clearing
-    uint32_t next_addr;
+    // Where block 0 of the image was written
+    uint32_t start;
+
+    // Pages where an image started before this download, plus the new
+    // image's own start.  Each image is taken to run up to the next one.
+    uint32_t images[2];
 
     enum {
         /// Toboot has just started
@@ -65,34 +81,88 @@ static struct toboot_state {
     } state;
 } tb_state;
 
+// The parts of the erase plan that don't depend on the incoming image.
+// These are worked out in dfu_init(), before the host sends anything.
+static struct {
+    bool valid;
+
+    // Set if the secure-erase mask covers every page after Toboot
+    bool wiped;
+
+    // The old configuration's secure-erase mask, minus Toboot itself
+    uint32_t secure[2];
+
+    // Pages holding a valid V2 header, which must go if the new image
+    // isn't V2
+    uint32_t headers[2];
+} fl_plan;
+
 static dfu_state_t dfu_state = dfuIDLE;
 static dfu_status_t dfu_status = OK;
 static unsigned dfu_poll_timeout = 1;
 
-static uint32_t dfu_buffer[DFU_TRANSFER_SIZE/4];
-static uint32_t dfu_buffer_offset;
-static uint32_t fl_num_words;
+// A block received from the host, waiting to be written to flash.  A
+// block may span several pages, which are erased and programmed in turn.
+struct dfu_block {
+    uint32_t buffer[DFU_TRANSFER_SIZE/4];
+    uint32_t address;
+    uint32_t num_words;
 
-// Memory offset we're uploading to.
-static uint32_t dfu_target_address;
+    // The page within the block that's being written
+    uint32_t page;
+
+    // The host's blockNum
+    uint32_t num;
+};
+
+// Blocks form a small ring.  The block at fl_head is the one the flash
+// state machine is working on, and fl_count blocks (including that one)
+// are waiting to be programmed.  The next free slot after those is where
+// the host's next DNLOAD is received, so USB can fill one buffer while
+// the flash controller drains another.
+static struct dfu_block dfu_blocks[DFU_NUM_BUFFERS];
+static unsigned fl_head;
+static unsigned fl_count;
+
+static struct dfu_stats dfu_stats;
 
 static void set_state(dfu_state_t new_state, dfu_status_t new_status) {
     dfu_state = new_state;
     dfu_status = new_status;
 }
 
+// Abandon the current flash operation, along with anything queued behind it.
+static void fl_fail(dfu_status_t new_status) {
+    set_state(dfuERROR, new_status);
+    fl_state = flsIDLE;
+    fl_count = 0;
+}
+
 bool fl_is_idle(void) {
-    return fl_state == flsIDLE;
+    return fl_state == flsIDLE && fl_count == 0;
 }
 
-void *memcpy(void *dst, const void *src, size_t cnt) {
-    uint8_t *dst8 = dst;
-    const uint8_t *src8 = src;
-    while (cnt > 0) {
-        cnt--;
-        *(dst8++) = *(src8++);
-    }
-    return dst;
+static struct dfu_block *fl_block(void) {
+    return &dfu_blocks[fl_head];
+}
+
+// The page of the head block that the flash state machine is working on
+static uint32_t fl_page_address(void) {
+    return fl_block()->address + fl_block()->page * DFU_PAGE_SIZE;
+}
+
+static const uint32_t *fl_page_data(void) {
+    return fl_block()->buffer + fl_block()->page * (DFU_PAGE_SIZE / 4);
+}
+
+static uint32_t fl_page_words(void) {
+    uint32_t left = fl_block()->num_words - fl_block()->page * (DFU_PAGE_SIZE / 4);
+
+    return left < DFU_PAGE_SIZE / 4 ? left : DFU_PAGE_SIZE / 4;
+}
+
+static struct dfu_block *rx_block(void) {
+    return &dfu_blocks[(fl_head + fl_count) & (DFU_NUM_BUFFERS - 1)];
 }
 
 static bool ftfl_busy()
@@ -108,35 +178,212 @@ static void ftfl_busy_wait()
         watchdog_refresh();
 }
 
-static void ftfl_begin_erase_sector(uint32_t address)
+// Returns true if every word of the page at the specified address is
+// already erased.  Checking a page takes far less time than erasing it.
+__attribute__((section(".ramtext")))
+static bool ftfl_page_is_blank(uint32_t address)
+{
+    return mem_is_blank((const void *)address, DFU_PAGE_SIZE);
+}
+
+// Compare the page at the specified address against what erasing and
+// programming it would leave there: the new data, followed by erased
+// words if the data is short.  Returns the index of the first word that
+// differs, or DFU_PAGE_SIZE/4 if the page already matches.
+__attribute__((section(".ramtext")))
+static uint32_t ftfl_page_mismatch(uint32_t address, const uint32_t *src, uint32_t num_words)
+{
+    const uint32_t *flash = (const uint32_t *)address;
+    uint32_t i = mem_mismatch32(flash, src, num_words);
+
+    if (i < num_words)
+        return i;
+    for (; i < DFU_PAGE_SIZE / 4; i++)
+        if (flash[i] != 0xffffffff)
+            return i;
+    return i;
+}
+
+static bool ftfl_page_matches(uint32_t address, const uint32_t *src, uint32_t num_words)
+{
+    return ftfl_page_mismatch(address, src, num_words) == DFU_PAGE_SIZE / 4;
+}
+
+static void fl_release_page(uint32_t page);
+
+// Returns true if an erase was started, or false if the page was already
+// blank and there was nothing to do.
+static bool ftfl_begin_erase_sector(uint32_t address)
 {
+    if (ftfl_page_is_blank(address)) {
+        dfu_stats.erases_skipped++;
+        return false;
+    }
+
     // Erase the page at the specified address.
     MSC->WRITECTRL |= MSC_WRITECTRL_WREN;
 
     ftfl_busy_wait();
+    fl_release_page(address / DFU_PAGE_SIZE);
     MSC->ADDRB = address;
     MSC->WRITECMD = MSC_WRITECMD_LADDRIM;
     MSC->WRITECMD = MSC_WRITECMD_ERASEPAGE;
+    return true;
 }
 
-static void ftfl_begin_program_section(uint32_t address)
+// The page being written by ftfl_program_poll(): the words still to go,
+// and where the next one goes.
+static struct {
+    const uint32_t *src;
+    const uint32_t *end;
+    uint32_t address;
+
+    // Set while a write sequence that src follows on from is running
+    bool running;
+
+    // Address of the last word that had to be written again, so it's
+    // only retried once.  0 is inside Toboot, and never programmed.
+    uint32_t retry_address;
+} ftfl_prog;
+
+// Program a page using the controller's back-to-back write mode, a word
+// at a time from fl_state_poll(), so the main loop keeps running while
+// the page is written.  WRITETRIG starts a sequence, and each following
+// word is loaded when WDATAREADY says the previous one has been latched,
+// with the address incrementing automatically.  Words that are still
+// erased (0xffffffff) are skipped, and a new sequence is started at the
+// next word that isn't.  The same happens if the main loop was away for
+// longer than the word timeout, and the sequence ended by itself.
+static void ftfl_begin_program(uint32_t address, const uint32_t *src, uint32_t num_words)
 {
-    // Write the buffer word to the currently selected address.
-    // Note that after this is done, the address is incremented by 4.
-    dfu_buffer_offset = 0;
-    dfu_target_address = address;
-    fl_num_words--;
-ftfl_busy_wait();
-    MSC->ADDRB = address;
-ftfl_busy_wait();
+    ftfl_busy_wait();
+    MSC->WRITECTRL |= MSC_WRITECTRL_WREN;
+    ftfl_prog.src = src;
+    ftfl_prog.end = src + num_words;
+    ftfl_prog.address = address;
+    ftfl_prog.running = false;
+    ftfl_prog.retry_address = 0;
+}
+
+// Load the next word, if the controller can take it.  Flash can't be
+// read while a word is being written, so this has to run from RAM.
+//
+// Returns true once the last word has been written, or the controller
+// has refused one.  A word that still doesn't read back after being
+// written twice fails the download with errWRITE.
+__attribute__((section(".ramtext")))
+static bool ftfl_program_poll(void)
+{
+    uint32_t status = MSC->STATUS;
+
+    if (status & MSC_STATUS_BUSY) {
+        if (ftfl_prog.running && (status & MSC_STATUS_WDATAREADY)
+         && ftfl_prog.src < ftfl_prog.end && *ftfl_prog.src != 0xffffffff) {
+            MSC->WDATA = *ftfl_prog.src++;
+            ftfl_prog.address += 4;
+        }
+        return false;
+    }
+
+    if (status & (MSC_STATUS_INVADDR | MSC_STATUS_LOCKED))
+        return true;
+
+    // The last word may have been loaded just as the sequence timed out,
+    // in which case it never got written.  Give it one more go.
+    if (ftfl_prog.running
+     && *(const uint32_t *)(ftfl_prog.address - 4) != ftfl_prog.src[-1]) {
+        ftfl_prog.src--;
+        ftfl_prog.address -= 4;
+        if (ftfl_prog.address == ftfl_prog.retry_address) {
+            fl_fail(errWRITE);
+            return false;
+        }
+        ftfl_prog.retry_address = ftfl_prog.address;
+    }
+    ftfl_prog.running = false;
+
+    while (ftfl_prog.src < ftfl_prog.end && *ftfl_prog.src == 0xffffffff) {
+        ftfl_prog.src++;
+        ftfl_prog.address += 4;
+    }
+    if (ftfl_prog.src == ftfl_prog.end)
+        return true;
+
+    MSC->ADDRB = ftfl_prog.address;
+    MSC->WRITECMD = MSC_WRITECMD_LADDRIM;
+    MSC->WDATA = *ftfl_prog.src++;
+    ftfl_prog.address += 4;
+    MSC->WRITECMD = MSC_WRITECMD_WRITETRIG;
+    ftfl_prog.running = true;
+    return false;
+}
+
+#if DFU_FLASH_DMA
+static bool ftfl_wait_status(uint32_t mask, uint32_t value)
+{
+    // Wait for a status bit to change, giving up if it takes too long.
+    uint32_t timeout = FTFL_WORD_TIMEOUT;
+    while ((MSC->STATUS & mask) != value)
+        if (--timeout == 0)
+            return false;
+    return true;
+}
+
+// Control data for the DMA controller.  The controller wants a table of
+// descriptors for all six channels, aligned to 256 bytes, but only
+// FTFL_DMA_CHANNEL is ever used, so this is the whole of the table as far
+// as we're concerned.  The linker script gives it a 256-byte aligned
+// section of its own.  Not static, so the linker script can check where
+// it ended up.
+DMA_DESCRIPTOR_TypeDef ftfl_dma_desc __attribute__((section(".dmactrl"), aligned(256)));
+
+static void ftfl_dma_init(void)
+{
+    DMA->CONFIG = DMA_CONFIG_EN;
+    DMA->CTRLBASE = (uint32_t)&ftfl_dma_desc;
+    DMA->CH[FTFL_DMA_CHANNEL].CTRL = DMA_CH_CTRL_SOURCESEL_MSC | DMA_CH_CTRL_SIGSEL_MSCWDATA;
+}
+
+static bool ftfl_dma_busy(void)
+{
+    return DMA->CHENS & (1 << FTFL_DMA_CHANNEL);
+}
+
+// Program a page by letting the DMA controller feed MSC->WDATA whenever
+// the MSC raises WDATAREADY.  This returns immediately, and
+// fl_state_poll() notices once the last word has been written.
+//
+// Returns false if the controller never took the first word.
+static bool ftfl_begin_program_dma(uint32_t address, const uint32_t *src, uint32_t num_words)
+{
+    ftfl_busy_wait();
     MSC->WRITECTRL |= MSC_WRITECTRL_WREN;
-    MSC->WDATA = dfu_buffer[dfu_buffer_offset++];
-    MSC->WRITECMD = MSC_WRITECMD_WRITEONCE;
+    MSC->ADDRB = address;
+    MSC->WRITECMD = MSC_WRITECMD_LADDRIM;
+
+    ftfl_dma_desc.SRCEND = &src[num_words - 1];
+    ftfl_dma_desc.DSTEND = &MSC->WDATA;
+    ftfl_dma_desc.CTRL = DMA_CTRL_DST_INC_NONE | DMA_CTRL_DST_SIZE_WORD
+                       | DMA_CTRL_SRC_INC_WORD | DMA_CTRL_SRC_SIZE_WORD
+                       | DMA_CTRL_R_POWER_1
+                       | ((num_words - 1) << _DMA_CTRL_N_MINUS_1_SHIFT)
+                       | DMA_CTRL_CYCLE_CTRL_BASIC;
+    DMA->CHENS = (1 << FTFL_DMA_CHANNEL);
+
+    // The first word goes in as soon as the channel is enabled, since
+    // WDATA starts out empty.  Triggering starts the write sequence.
+    if (!ftfl_wait_status(MSC_STATUS_WDATAREADY, 0)) {
+        DMA->CHENC = (1 << FTFL_DMA_CHANNEL);
+        return false;
+    }
+    MSC->WRITECMD = MSC_WRITECMD_WRITETRIG;
+    return true;
 }
+#endif
 
-static uint32_t address_for_block(unsigned blockNum)
+static uint32_t address_for_block(unsigned blockNum, const uint32_t *dfu_buffer)
 {
-    static uint32_t starting_offset;
+    uint32_t starting_offset;
     if (blockNum == 0) {
         // Determine Toboot version.
         if ((dfu_buffer[0x94 / 4] & TOBOOT_V2_MAGIC_MASK) == TOBOOT_V2_MAGIC) {
@@ -163,35 +410,171 @@ static uint32_t address_for_block(unsigned blockNum)
 
         // Set the state to "CLEARING", since we're just starting the programming process.
         tb_state.state = tbsCLEARING;
-        starting_offset *= 0x400;
+        return starting_offset * 0x400;
+    }
+    return tb_state.start + blockNum * DFU_TRANSFER_SIZE;
+}
+
+static bool page_in(const uint32_t mask[2], uint32_t page)
+{
+    if (page >= 64)
+        return false;
+    return mask[page / 32] & (1 << (page & 31));
+}
+
+static void page_add(uint32_t mask[2], uint32_t page)
+{
+    mask[page / 32] |= (1 << (page & 31));
+}
+
+static void page_remove(uint32_t mask[2], uint32_t page)
+{
+    mask[page / 32] &= ~(1 << (page & 31));
+}
+
+// Work out everything about the erase plan that can be known before the
+// first block arrives: the secure-erase mask, and where old V2 headers
+// live.  Scanning for headers hashes every page, so it's worth doing
+// while the host is still enumerating us.
+__attribute__ ((section(".startup")))
+static void fl_plan_init(void)
+{
+    const struct toboot_configuration *old_config = tb_get_config();
+    uint32_t first = tb_first_free_sector();
+    uint32_t page;
+
+    // Ensure we don't erase Toboot itself
+    fl_plan.secure[0] = old_config->erase_mask_lo & (0xffffffff << first);
+    fl_plan.secure[1] = old_config->erase_mask_hi;
+
+    // The factory case is an erase mask that covers all of flash
+    // after Toboot.  The EFM32HG's only bigger erase, ERASEMAIN0,
+    // would take Toboot with it, so this still means one page erase
+    // per page, and the only saving is not having to look for old
+    // headers.  Each page pre-clearing erases is marked blank, so
+    // nothing gets erased twice either way.
+    fl_plan.wiped = (fl_plan.secure[0] == (0xffffffff << first))
+                 && (fl_plan.secure[1] == 0xffffffff);
+
+    fl_plan.headers[0] = 0;
+    fl_plan.headers[1] = 0;
+    if (!fl_plan.wiped) {
+        for (page = first; page < 64; page++) {
+            if (tb_valid_signature_at_page(page) < 0)
+                continue;
+            page_add(fl_plan.headers, page);
+        }
     }
-    return starting_offset + (blockNum << 10);
+
+    fl_plan.valid = true;
+}
+
+// A page with something in it is about to be erased.  If it's part of
+// another image, that image can't be rolled back to any more, so
+// invalidate it while it's still intact.
+static void fl_release_page(uint32_t page)
+{
+    int owner;
+
+    // The user data page doesn't belong to any image
+    if (page >= 64)
+        return;
+
+    for (owner = page; owner >= 0; owner--)
+        if (page_in(tb_state.images, owner))
+            break;
+
+    if (owner < 0 || (uint32_t)owner == tb_state.start / DFU_PAGE_SIZE)
+        return;
+    if (tb_valid_signature_at_page(owner) < 0)
+        return;
+    tb_invalidate_config_at_page(owner);
 }
 
+static void fl_erase_block(void);
+static void fl_begin_program(void);
+static void fl_finish_page(void);
+
 // If requested, erase sectors before loading new code.
 static void pre_clear_next_block(void) {
 
-    // If there is another sector to clear, do that.
+    // If there is another sector to clear, do that.  Either way, it
+    // will be blank when we're done, so it won't need erasing again.
     while (++tb_state.clear_current < 64) {
-        if (tb_state.clear_current < 32) {
-            if ((tb_state.clear_lo & (1 << tb_state.clear_current))) {
-                ftfl_begin_erase_sector(tb_state.clear_current * 1024);
-                return;
-            }
-        }
-        else if (tb_state.clear_current < 64) {
-            if ((tb_state.clear_hi & (1 << (tb_state.clear_current & 31)))) {
-                ftfl_begin_erase_sector(tb_state.clear_current * 1024);
-                return;
-            }
-        }
+        if (!page_in(tb_state.clear, tb_state.clear_current))
+            continue;
+        page_add(tb_state.blank, tb_state.clear_current);
+        if (ftfl_begin_erase_sector(tb_state.clear_current * DFU_PAGE_SIZE))
+            return;
     }
 
     // No more sectors to clear, continue with programming
     tb_state.state = tbsLOADING;
-    ftfl_begin_erase_sector(tb_state.next_addr);
+    fl_erase_block();
+}
+
+// Erase the next page of the block at the head of the queue.  If it was
+// erased while pre-clearing, check that it really did come out blank,
+// which takes a fraction of the time of the erase, and start programming
+// it right away.  If it already holds this data, there's nothing to do at
+// all.  This check happens after any pre-clearing, and a V2 header page
+// never matches since it carries a new generation and signature.
+static void fl_erase_block(void)
+{
+    uint32_t page = fl_page_address() / DFU_PAGE_SIZE;
+
+    fl_state = flsERASING;
+    if (page_in(tb_state.blank, page)) {
+        page_remove(tb_state.blank, page);
+        if (!ftfl_page_is_blank(fl_page_address()))
+            fl_fail(errCHECK_ERASED);
+        else
+            fl_begin_program();
+    }
+    else if (ftfl_page_matches(fl_page_address(), fl_page_data(), fl_page_words())) {
+        dfu_stats.pages_unchanged++;
+        fl_finish_page();
+    }
+    else if (!ftfl_begin_erase_sector(fl_page_address()))
+        fl_begin_program();
+}
+
+// Start erasing the block at the head of the queue.  If we're still
+// pre-clearing, that happens first and the block is erased afterwards.
+static void fl_begin_next_block(void)
+{
+    fl_state = flsERASING;
+    if (tb_state.state == tbsCLEARING)
+        pre_clear_next_block();
+    else
+        fl_erase_block();
+}
+
+// The block at the head of the queue has been written.  Release its
+// buffer and move on to the next one, if the host has sent it already.
+static void fl_finish_block(void)
+{
+    fl_head = (fl_head + 1) & (DFU_NUM_BUFFERS - 1);
+    fl_count--;
+    fl_state = flsIDLE;
+    if (fl_count > 0)
+        fl_begin_next_block();
 }
 
+// A page of the head block has been written.  Move on to the next page
+// of the block, or the next block if that was the last page.
+static void fl_finish_page(void)
+{
+    struct dfu_block *block = fl_block();
+
+    block->page++;
+    if (block->page * (DFU_PAGE_SIZE / 4) < block->num_words)
+        fl_erase_block();
+    else
+        fl_finish_block();
+}
+
+__attribute__ ((section(".startup")))
 void dfu_init(void)
 {
     tb_state.state = tbsIDLE;
@@ -204,10 +587,16 @@ void dfu_init(void)
     // Unlock the MSC
     MSC->LOCK = MSC_UNLOCK_CODE;
 
-    // Enable writing to flash
+    fl_plan_init();
+
+#if DFU_FLASH_DMA
+    ftfl_dma_init();
+#endif
+
+    // Enable writing to flash.  There's no need for the MSC or DMA
+    // interrupts: dfu_poll() is called from the main loop, and checks on
+    // the flash controller each time round.
     MSC->WRITECTRL |= MSC_WRITECTRL_WREN;
-    MSC->IEN |= MSC_IEN_WRITE | MSC_IEN_ERASE;
-    NVIC_EnableIRQ(MSC_IRQn);
 }
 
 uint8_t dfu_getstate(void)
@@ -215,49 +604,41 @@ uint8_t dfu_getstate(void)
     return dfu_state;
 }
 
-bool dfu_download(unsigned blockNum, unsigned blockLength,
-    unsigned packetOffset, unsigned packetLength, const uint8_t *data)
+__attribute__ ((section(".startup")))
+const struct dfu_stats *dfu_getstats(void)
 {
-    uint32_t i;
-
-    if (packetOffset + packetLength > DFU_TRANSFER_SIZE ||
-        packetOffset + packetLength > blockLength) {
-
-        // Overflow!
-        set_state(dfuERROR, errADDRESS);
-        return false;
-    }
+    return &dfu_stats;
+}
 
-    // Store more data...
-    memcpy(((uint8_t *)dfu_buffer) + packetOffset, data, packetLength);
+// Queue a complete block for the flash state machine.  If it's the first
+// block, this also works out where the image goes and what needs erasing.
+static bool dfu_queue_block(unsigned blockNum, unsigned blockLength)
+{
+    struct dfu_block *block = rx_block();
+    uint32_t *dfu_buffer = block->buffer;
 
-    if (packetOffset + packetLength != blockLength) {
-        // Still waiting for more data.
-        return true;
-    }
+    // Pad a short block out to a whole word.
+    while (blockLength & 3)
+        ((uint8_t *)dfu_buffer)[blockLength++] = 0xff;
 
-    if (dfu_state != dfuIDLE && dfu_state != dfuDNLOAD_IDLE) {
-        // Wrong state! Oops.
-        set_state(dfuERROR, errSTALLEDPKT);
-        return false;
-    }
-
-    if (ftfl_busy() || fl_state != flsIDLE) {
+    if (blockNum == 0 && (ftfl_busy() || !fl_is_idle())) {
         // Flash controller shouldn't be busy now!
         set_state(dfuERROR, errUNKNOWN);
-        return false;       
+        return false;
     }
 
-    if (!blockLength) {
-        // End of download
-        set_state(dfuMANIFEST_SYNC, OK);
-        return true;
+    // Blocks may be skipped, for a host that only sends pages that have
+    // changed.  But block 0 holds the header, which says where the image
+    // goes and always changes since it's re-signed, so it must come first.
+    if (blockNum != 0 && tb_state.state == tbsIDLE) {
+        set_state(dfuERROR, errADDRESS);
+        return false;
     }
 
-    // Start programming a block by erasing the corresponding flash sector
-    fl_state = flsERASING;
-    fl_current_addr = address_for_block(blockNum);
-    fl_num_words = blockLength / 4;
+    block->address = address_for_block(blockNum, dfu_buffer);
+    block->num_words = blockLength / 4;
+    block->page = 0;
+    block->num = blockNum;
 
     // If it's the first block, figure out what we need to do in terms of erasing
     // data and programming the new file.
@@ -265,7 +646,7 @@ bool dfu_download(unsigned blockNum, unsigned blockLength,
         const struct toboot_configuration *old_config = tb_get_config();
 
         // Don't allow overwriting Toboot itself.
-        if (fl_current_addr < tb_first_free_address()) {
+        if (block->address < tb_first_free_address()) {
             set_state(dfuERROR, errADDRESS);
             return false;
         }
@@ -284,53 +665,117 @@ bool dfu_download(unsigned blockNum, unsigned blockLength,
             tb_sign_config(new_config);
         }
 
+        tb_state.start = block->address;
+
+        dfu_stats.erases_skipped = 0;
+        dfu_stats.pages_unchanged = 0;
+        dfu_stats.verify_address = 0;
+
+        // Pick up the erase plan worked out in dfu_init().  If an earlier
+        // download has been writing to flash since then, redo it.
+        if (!fl_plan.valid)
+            fl_plan_init();
+        fl_plan.valid = false;
+
+        tb_state.images[0] = fl_plan.headers[0];
+        tb_state.images[1] = fl_plan.headers[1];
+        page_add(tb_state.images, tb_state.start / DFU_PAGE_SIZE);
+
         // If the old configuration requires that certain blocks be erased, do that.
-        tb_state.clear_hi = old_config->erase_mask_hi;
-        tb_state.clear_lo = old_config->erase_mask_lo;
+        tb_state.clear[0] = fl_plan.secure[0];
+        tb_state.clear[1] = fl_plan.secure[1];
+        tb_state.blank[0] = 0;
+        tb_state.blank[1] = 0;
         tb_state.clear_current = 0;
 
-        // Ensure we don't erase Toboot itself
-        for (i = 0; i < tb_first_free_sector(); i++) {
-            if (i < 32)
-                tb_state.clear_lo &= ~(1 << i);
-            else
-                tb_state.clear_hi &= ~(1 << i);
-        }
-
-        // If the newly-loaded program does not conform to Toboot V2.0, then look
-        // for any existing programs on the flash and delete those sectors.
-        // Because of boot priority, we need to ensure that no V2.0 applications
-        // exist on flash.
+        // If the newly-loaded program does not conform to Toboot V2.0, then
+        // delete any existing V2.0 programs on the flash.  Because of boot
+        // priority, we need to ensure that none remain.
         if (tb_state.version < 2) {
-            for (i = tb_first_free_sector(); i < 64; i++) {
-                if (tb_valid_signature_at_page(i) < 0)
-                    continue;
-                if (i < 32)
-                    tb_state.clear_lo |= (1 << i);
-                else
-                    tb_state.clear_hi |= (1 << (i - 32));
-            }
+            tb_state.clear[0] |= fl_plan.headers[0];
+            tb_state.clear[1] |= fl_plan.headers[1];
         }
 
         // If we still have sectors to clear, do that.  Otherwise,
         // go straight into loading the program.
-        if (tb_state.clear_lo || tb_state.clear_hi) {
+        if (tb_state.clear[0] || tb_state.clear[1])
             tb_state.state = tbsCLEARING;
-            tb_state.next_addr = fl_current_addr;
-            pre_clear_next_block();
-        }
-        else {
+        else
             tb_state.state = tbsLOADING;
-            ftfl_begin_erase_sector(fl_current_addr);
-        }
     }
-    else
-        ftfl_begin_erase_sector(fl_current_addr);
+
+    // Queue the block.  dfu_poll() starts on it once the flash
+    // controller is free.
+    fl_count++;
+
+    return true;
+}
+
+bool dfu_download(unsigned blockNum, unsigned blockLength,
+    unsigned packetOffset, unsigned packetLength)
+{
+    if (packetOffset + packetLength > DFU_TRANSFER_SIZE ||
+        packetOffset + packetLength > blockLength) {
+
+        // Overflow!
+        set_state(dfuERROR, errADDRESS);
+        return false;
+    }
+
+    if (fl_count >= DFU_NUM_BUFFERS) {
+        // Every buffer is still waiting to be programmed.  The host
+        // should have waited for dfuDNLOAD_IDLE before sending more.
+        set_state(dfuERROR, errUNKNOWN);
+        return false;
+    }
+
+    if (packetOffset + packetLength != blockLength) {
+        // Still waiting for more data.
+        return true;
+    }
+
+    if (dfu_state != dfuIDLE && dfu_state != dfuDNLOAD_IDLE) {
+        // Wrong state! Oops.
+        set_state(dfuERROR, errSTALLEDPKT);
+        return false;
+    }
+
+    if (!blockLength) {
+        // End of download.  Any blocks still queued will be finished
+        // before we report that manifestation is complete.
+        set_state(dfuMANIFEST_SYNC, OK);
+        return true;
+    }
+
+    if (!dfu_queue_block(blockNum, blockLength))
+        return false;
 
     set_state(dfuDNLOAD_SYNC, OK);
     return true;
 }
 
+// Where the packets of a DNLOAD block should be received, so that they
+// land straight in the buffer they'll be programmed from.  Returns NULL
+// for stall if the block can't be taken.
+__attribute__ ((section(".startup")))
+uint8_t *dfu_download_buffer(unsigned blockNum, unsigned blockLength)
+{
+    (void)blockNum;
+
+    if (blockLength > DFU_TRANSFER_SIZE) {
+        set_state(dfuERROR, errADDRESS);
+        return NULL;
+    }
+
+    if (fl_count >= DFU_NUM_BUFFERS) {
+        // Every buffer is still waiting to be programmed.
+        set_state(dfuERROR, errUNKNOWN);
+        return NULL;
+    }
+
+    return (uint8_t *)rx_block()->buffer;
+}
+
 static bool fl_handle_status(uint8_t fstat)
 {
     /*
@@ -346,26 +791,67 @@ static bool fl_handle_status(uint8_t fstat)
         return true;
     }
 
-    if (fstat & (MSC_STATUS_ERASEABORTED | MSC_STATUS_WORDTIMEOUT)) {
+    // WORDTIMEOUT isn't checked: a WRITETRIG sequence always ends with a
+    // word timeout once we stop feeding it data.
+    if (fstat & MSC_STATUS_ERASEABORTED) {
         // Bus collision. We did something wrong internally.
-        set_state(dfuERROR, errUNKNOWN);
-        fl_state = flsIDLE;
+        fl_fail(errUNKNOWN);
         return true;
     }
 
     if (fstat & (MSC_STATUS_INVADDR | MSC_STATUS_LOCKED)) {
         // Address or protection error
-        set_state(dfuERROR, errADDRESS);
-        fl_state = flsIDLE;
+        fl_fail(errADDRESS);
         return true;
     }
 
-    if (fl_state == flsPROGRAMMING) {
-        // Still programming...
-        return true;
+    return false;
+}
+
+// Read the page back before moving on, so a weak cell or a brownout
+// shows up now rather than when the program runs.  The host is sending
+// the next block into the other buffer meanwhile, so this doesn't hold
+// anything up.
+static void fl_verify_page(void)
+{
+#if DFU_VERIFY
+    uint32_t i = ftfl_page_mismatch(fl_page_address(), fl_page_data(), fl_page_words());
+
+    if (i < DFU_PAGE_SIZE / 4) {
+        dfu_stats.verify_address = fl_page_address() + i * 4;
+        fl_fail(errVERIFY);
+        return;
     }
+#endif
+    fl_finish_page();
+}
 
-    return false;
+// Erasing is done, so write the current page of the block at the head
+// of the queue.
+static void fl_begin_program(void)
+{
+    const uint32_t *src = fl_page_data();
+    uint32_t num_words = fl_page_words();
+
+    fl_state = flsPROGRAMMING;
+
+    // Trailing erased words don't need to be written.  A page that's
+    // entirely 0xff is finished as soon as it has been erased.
+    while (num_words && src[num_words - 1] == 0xffffffff)
+        num_words--;
+
+    if (!num_words) {
+        fl_verify_page();
+        return;
+    }
+
+#if DFU_FLASH_DMA
+    if (!ftfl_begin_program_dma(fl_page_address(), src, num_words)
+     && !fl_handle_status(MSC->STATUS))
+        fl_fail(errPROG);
+#else
+    ftfl_begin_program(fl_page_address(), src, num_words);
+#endif
 }
 
 static void fl_state_poll(void)
@@ -381,55 +867,72 @@ static void fl_state_poll(void)
 
         case flsERASING:
             if (!fl_handle_status(fstat)) {
+
                 // ?If we're still pre-clearing, continue with that.
                 if (tb_state.state == tbsCLEARING) {
                     pre_clear_next_block();
                 }
                 // Done! Move on to programming the sector.
                 else {
-                    fl_state = flsPROGRAMMING;
-                    ftfl_begin_program_section(fl_current_addr);
+                    fl_begin_program();
                 }
             }
             break;
 
         case flsPROGRAMMING:
-            if (!fl_handle_status(fstat)) {
-                // Done!
-                fl_state = flsIDLE;
-            }
+#if DFU_FLASH_DMA
+            // Finished once the DMA has handed over every word and the
+            // MSC has written the last one.  Look at the DMA first, so
+            // the status is read after the last word went in.
+            if (!ftfl_dma_busy() && !fl_handle_status(MSC->STATUS))
+                fl_verify_page();
+#else
+            if (ftfl_program_poll() && !fl_handle_status(MSC->STATUS))
+                fl_verify_page();
+#endif
             break;
     }
 }
 
+__attribute__ ((section(".startup")))
 bool dfu_getstatus(uint8_t status[8])
 {
     switch (dfu_state) {
 
         case dfuDNLOAD_SYNC:
         case dfuDNBUSY:
-            // Programming operation in progress. Advance our private flash state machine.
-            fl_state_poll();
-
-            if (dfu_state == dfuERROR) {
-                // An error occurred inside fl_state_poll();
-            } else if (fl_state == flsIDLE) {
-                dfu_state = dfuDNLOAD_IDLE;
+            // Programming operation in progress.  The main loop moves the
+            // flash state machine along; a failure puts us in dfuERROR.
+            if (fl_count < DFU_NUM_BUFFERS) {
+                // There's a free buffer, so the host may send the next
+                // block while the flash controller works on this one.
+                // There's no need for it to wait before doing so.
+                set_state(dfuDNLOAD_IDLE, dfu_status);
+                dfu_poll_timeout = 0;
             } else {
-                dfu_state = dfuDNBUSY;
+                // Every buffer is full, so the host has to wait for the
+                // block at the head of the queue to be written.
+                set_state(dfuDNBUSY, dfu_status);
+                dfu_poll_timeout = 1;
             }
             break;
 
         case dfuMANIFEST_SYNC:
+            // Wait for any blocks that are still queued up.
+            if (!fl_is_idle()) {
+                dfu_poll_timeout = 1;
+                break;
+            }
+
             // Ready to reboot. The main thread will take care of this. Also let the DFU tool
             // know to leave us alone until this happens.
-            dfu_state = dfuMANIFEST;
+            set_state(dfuMANIFEST, dfu_status);
             dfu_poll_timeout = 10;
             break;
 
         case dfuMANIFEST:
             // Perform the reboot
-            dfu_state = dfuMANIFEST_WAIT_RESET;
+            set_state(dfuMANIFEST_WAIT_RESET, dfu_status);
             dfu_poll_timeout = 1000;
             break;
 
@@ -447,6 +950,7 @@ bool dfu_getstatus(uint8_t status[8])
     return true;
 }
 
+__attribute__ ((section(".startup")))
 bool dfu_clrstatus(void)
 {
     switch (dfu_state) {
@@ -463,32 +967,20 @@ bool dfu_clrstatus(void)
     }
 }
 
+__attribute__ ((section(".startup")))
 bool dfu_abort(void)
 {
     set_state(dfuIDLE, OK);
     return true;
 }
 
-void MSC_Handler(void) {
-    uint32_t msc_irq_reason = MSC->IF;
-
-    if (msc_irq_reason & MSC_IF_WRITE) {
-        // Write the buffer word to the currently selected address.
-        // Note that after this is done, the address is incremented by 4.
-        if (fl_num_words > 0) {
-            fl_num_words--;
-            dfu_target_address += 4;
-            MSC->ADDRB = dfu_target_address;
-            ftfl_busy_wait();
-            MSC->WDATA = dfu_buffer[dfu_buffer_offset++]; 
-            MSC->WRITECMD = MSC_WRITECMD_WRITEONCE;
-        }
-        else {
-            // Move to the IDLE state only if we're out of data to write.
-            fl_state = flsIDLE;
-        }
-    }
-
-    // Clear iterrupts so we don't fire again.
-    MSC->IFC = MSC_IFC_ERASE | MSC_IFC_WRITE;
-}
\ No newline at end of file
+// Move the flash state machine along.  This is called from the main loop
+// rather than the MSC interrupt, so erasing, programming and checking
+// pages never hold up USB.
+void dfu_poll(void)
+{
+    if (fl_state == flsIDLE && fl_count > 0)
+        fl_begin_next_block();
+    else
+        fl_state_poll();
+}
@@ -62,20 +62,67 @@ typedef enum {
 } dfu_status_t;
 
 #define DFU_INTERFACE             0
+#define DFU_VENDOR_GET_STATS      0x10      // bRequest for struct dfu_stats
 #define DFU_DETACH_TIMEOUT        10000     // 10 second timer
-#define DFU_TRANSFER_SIZE         1024      // Flash sector size
+#define DFU_PAGE_SIZE             1024      // Flash sector size
+
+// Bytes per DNLOAD block, advertised as wTransferSize.  Must be a whole
+// number of pages.  Each buffer takes this much RAM.
+#ifndef DFU_TRANSFER_SIZE
+#define DFU_TRANSFER_SIZE         1024
+#endif
+
+#if (DFU_TRANSFER_SIZE % DFU_PAGE_SIZE) != 0
+#error "DFU_TRANSFER_SIZE must be a multiple of DFU_PAGE_SIZE"
+#endif
+
+// Blocks that can wait for the flash at once.  With 2, the host can
+// send the next block while the last one is written.  1 saves
+// DFU_TRANSFER_SIZE of RAM.
+#ifndef DFU_NUM_BUFFERS
+#define DFU_NUM_BUFFERS           2         // Must be a power of two
+#endif
+
+// Read each page back once it's programmed, and fail the download with
+// errVERIFY if it doesn't match.
+#ifndef DFU_VERIFY
+#define DFU_VERIFY                0
+#endif
+
+// Flash programming back end.  0 streams each page from the CPU,
+// 1 feeds MSC->WDATA by DMA so the CPU is free while a page is written.
+#ifndef DFU_FLASH_DMA
+#define DFU_FLASH_DMA             0
+#endif
+
+// Counters describing the current (or most recent) download.
+struct dfu_stats {
+    // Page erases avoided because the page was already blank
+    uint32_t erases_skipped;
+
+    // Pages that already matched flash, and so were neither erased
+    // nor programmed
+    uint32_t pages_unchanged;
+
+    // The first word that didn't read back as written, if the download
+    // failed with errVERIFY.  Otherwise 0.
+    uint32_t verify_address;
+};
 
 // Main thread
 void dfu_init();
+void dfu_poll(void);
 
-// USB entry points. Always successful.
+// USB entry points, called from the main loop by usb_poll(). Always successful.
 uint8_t dfu_getstate();
+const struct dfu_stats *dfu_getstats();
 
-// USB entry points. True on success, false for stall.
+// USB entry points, as above. True on success, false for stall.
 bool dfu_getstatus(uint8_t status[8]);
 bool dfu_clrstatus();
 bool dfu_abort();
 bool dfu_download(unsigned blockNum, unsigned blockLength,
-unsigned packetOffset, unsigned packetLength, const uint8_t *data);
+unsigned packetOffset, unsigned packetLength);
+uint8_t *dfu_download_buffer(unsigned blockNum, unsigned blockLength);
 
 #endif /* _DFU_H */
\ No newline at end of file
@@ -9,6 +9,9 @@
 
 #define RTC_INTERVAL_MSEC 250
 
+// Warm resets in a row before a program counts as failing to boot
+#define BOOT_TRIES 3
+
 static uint32_t *app_vectors;
 enum bootloader_reason bootloader_reason;
 __attribute__((noreturn)) void updater(void);
@@ -47,6 +50,10 @@ static void start_rtc(void)
     RTC->CTRL = RTC_CTRL_COMP0TOP | RTC_CTRL_DEBUGRUN | RTC_CTRL_EN;
 }
 
+// The boot path runs straight from flash, rather than taking up RAM.
+// Its only flash write, confirming a program, waits in tb_write_word()
+// until it's done.
+__attribute__ ((section(".startup")))
 void __early_init(void)
 {
     // Enable peripheral clocks.
@@ -128,6 +135,7 @@ static void busy_wait(int count)
 #define READ_CAP0B() (GPIO->P[4].DIN & (1 << 12))
 #define TOGGLE_CAP1A() (GPIO->P[2].DOUTTGL = (1 << 1))
 
+__attribute__ ((section(".startup")))
 int test_pin_short(const struct toboot_configuration *cfg)
 {
     int samples[4];
@@ -207,7 +215,7 @@ static int test_reset_cause(const struct toboot_configuration *cfg)
 static int test_boot_failures(const struct toboot_configuration *cfg)
 {
     (void)cfg;
-    return boot_token.boot_count >= 3;
+    return boot_token.boot_count >= BOOT_TRIES;
 }
 
 static int test_application_invalid(const struct toboot_configuration *cfg)
@@ -256,11 +264,41 @@ static int should_enter_bootloader(const struct toboot_configuration *cfg)
         return 1;
     }
 
-    // If we've failed to boot many times, enter the bootloader
+    // A program on trial confirms itself through the boot token.  That
+    // only counts if it was the one that ran last, and not a program it
+    // was rolled back to, which is the case once boot_count has passed
+    // BOOT_TRIES.
+    if (boot_token.magic == TOBOOT_CONFIRM_MAGIC)
+    {
+        if ((cfg->config & TOBOOT_CONFIG_FLAG_CONFIRM) && boot_token.boot_count <= BOOT_TRIES)
+        {
+            tb_confirm_config(cfg);
+            boot_token.boot_count = 0;
+        }
+        boot_token.magic = 0;
+    }
+
+    // If we've failed to boot many times, enter the bootloader.  A
+    // program on trial gets rolled back instead, by booting the previous
+    // program.  Nothing is written to flash, and boot_count keeps going
+    // up, so each reset comes back here until a power cycle gives the
+    // program on trial another go.  If the program it was rolled back
+    // to fails just as often, or there's nothing to roll back to, enter
+    // the bootloader.
     if (test_boot_failures(cfg))
     {
-        bootloader_reason = BOOT_FAILED_TOO_MANY_TIMES;
-        return 1;
+        const struct toboot_configuration *previous = NULL;
+
+        if ((cfg->config & TOBOOT_CONFIG_FLAG_CONFIRM) && boot_token.boot_count < 2 * BOOT_TRIES)
+            previous = tb_get_previous_config(cfg);
+        if (!previous)
+        {
+            bootloader_reason = BOOT_FAILED_TOO_MANY_TIMES;
+            return 1;
+        }
+
+        cfg = previous;
+        app_vectors = (uint32_t *)(1024 * cfg->start);
     }
 
     // If there is no valid program, enter the bootloader
@@ -274,7 +312,7 @@ static int should_enter_bootloader(const struct toboot_configuration *cfg)
     return 0;
 }
 
-__attribute__((noreturn)) static void boot_app(void)
+__attribute__((noreturn, section(".startup"))) static void boot_app(void)
 {
     // Relocate IVT to application flash
     __disable_irq();
@@ -335,7 +373,7 @@ __attribute__((noreturn)) static void boot_app(void)
         ;
 }
 
-__attribute__((noreturn)) void bootloader_main(void)
+__attribute__((noreturn, section(".startup"))) void bootloader_main(void)
 {
     const struct toboot_configuration *cfg = tb_get_config();
     app_vectors = (uint32_t *)(1024 * cfg->start);
@@ -110,6 +110,65 @@ typedef struct
   __IO uint32_t IRQLATENCY;   /**< Irq Latency Register  */
 } MSC_TypeDef;
 
+/** \brief  EFM32HG_DMA_CH Register Declaration
+ */
+typedef struct
+{
+  __IO uint32_t CTRL; /**< Channel Control Register  */
+} DMA_CH_TypeDef;
+
+/** \brief  EFM32HG_DMA Register Declaration
+ */
+typedef struct
+{
+  __I uint32_t   STATUS;         /**< DMA Status Registers  */
+  __O uint32_t   CONFIG;         /**< DMA Configuration Register  */
+  __IO uint32_t  CTRLBASE;       /**< Channel Control Data Base Pointer Register  */
+  __I uint32_t   ALTCTRLBASE;    /**< Channel Alternate Control Data Base Pointer Register  */
+  __I uint32_t   CHWAITSTATUS;   /**< Channel Wait on Request Status Register  */
+  __O uint32_t   CHSWREQ;        /**< Channel Software Request Register  */
+  __IO uint32_t  CHUSEBURSTS;    /**< Channel Useburst Set Register  */
+  __O uint32_t   CHUSEBURSTC;    /**< Channel Useburst Clear Register  */
+  __IO uint32_t  CHREQMASKS;     /**< Channel Request Mask Set Register  */
+  __O uint32_t   CHREQMASKC;     /**< Channel Request Mask Clear Register  */
+  __IO uint32_t  CHENS;          /**< Channel Enable Set Register  */
+  __O uint32_t   CHENC;          /**< Channel Enable Clear Register  */
+  __IO uint32_t  CHALTS;         /**< Channel Alternate Set Register  */
+  __O uint32_t   CHALTC;         /**< Channel Alternate Clear Register  */
+  __IO uint32_t  CHPRIS;         /**< Channel Priority Set Register  */
+  __O uint32_t   CHPRIC;         /**< Channel Priority Clear Register  */
+  uint32_t       RESERVED0[3];   /**< Reserved for future use **/
+  __IO uint32_t  ERRORC;         /**< Bus Error Clear Register  */
+  uint32_t       RESERVED1[880]; /**< Reserved for future use **/
+  __I uint32_t   CHREQSTATUS;    /**< Channel Request Status  */
+  uint32_t       RESERVED2[1];   /**< Reserved future */
+  __I uint32_t   CHSREQSTATUS;   /**< Channel Single Request Status  */
+  uint32_t       RESERVED3[121]; /**< Reserved for future use **/
+  __I uint32_t   IF;             /**< Interrupt Flag Register  */
+  __IO uint32_t  IFS;            /**< Interrupt Flag Set Register  */
+  __IO uint32_t  IFC;            /**< Interrupt Flag Clear Register  */
+  __IO uint32_t  IEN;            /**< Interrupt Enable register  */
+  __IO uint32_t  CTRL;           /**< DMA Control Register  */
+  __IO uint32_t  RDS;            /**< DMA Retain Descriptor State  */
+  uint32_t       RESERVED4[2];   /**< Reserved for future use **/
+  __IO uint32_t  LOOP0;          /**< Channel 0 Loop Register  */
+  __IO uint32_t  LOOP1;          /**< Channel 1 Loop Register  */
+  uint32_t       RESERVED5[14];  /**< Reserved for future use **/
+  __IO uint32_t  RECT0;          /**< Channel 0 Rectangle Register  */
+  uint32_t       RESERVED6[39];  /**< Reserved registers */
+  DMA_CH_TypeDef CH[6];          /**< Channel registers */
+} DMA_TypeDef;
+
+/** \brief  DMA channel control data structure (descriptor), stored in RAM
+ */
+typedef struct
+{
+  volatile const void *SRCEND; /**< DMA source address end  */
+  volatile void *DSTEND;       /**< DMA destination address end  */
+  __IO uint32_t CTRL;          /**< DMA control register  */
+  __IO uint32_t USER;          /**< DMA padding register, available for user  */
+} DMA_DESCRIPTOR_TypeDef;
+
 /** \brief  EFM32HG_CMU Register Declaration
  */
 typedef struct
@@ -407,6 +466,7 @@ typedef struct
 #define RTC_BASE            (0x40080000UL)                            /*!< RTC Base Address                  */
 #define WDOG_BASE           (0x40088000UL)                            /*!< WDOG Base Address                 */
 #define MSC_BASE            (0x400C0000UL)                            /*!< MSC Base Address                  */
+#define DMA_BASE            (0x400C2000UL)                            /*!< DMA Base Address                  */
 #define USB_BASE            (0x400C4000UL)                            /*!< USB Base Address                  */
 #define EMU_BASE            (0x400C6000UL)                            /*!< EMU Base Address                  */
 #define CMU_BASE            (0x400C8000UL)                            /*!< CMU Base Address                  */
@@ -421,6 +481,7 @@ typedef struct
 #define RTC                 ((RTC_TypeDef    *)     RTC_BASE      )   /*!< RTC configuration struct           */
 #define WDOG                ((WDOG_TypeDef   *)     WDOG_BASE     )   /*!< Watchdog configuration struct      */
 #define MSC                 ((MSC_TypeDef    *)     MSC_BASE      )   /*!< Memory Storage Controller configuration struct */
+#define DMA                 ((DMA_TypeDef    *)     DMA_BASE      )   /*!< DMA configuration struct           */
 #define USB                 ((USB_TypeDef    *)     USB_BASE      )   /*!< USB configuration struct           */
 #define EMU                 ((EMU_TypeDef    *)     EMU_BASE      )   /*!< Energy Management Unit configuration struct */
 #define CMU                 ((CMU_TypeDef    *)     CMU_BASE      )   /*!< CMU configuration struct           */
@@ -3364,6 +3425,29 @@ typedef struct
 #define _MSC_IRQLATENCY_IRQLATENCY_DEFAULT      0x00000000UL                              /**< Mode DEFAULT for MSC_IRQLATENCY */
 #define MSC_IRQLATENCY_IRQLATENCY_DEFAULT       (_MSC_IRQLATENCY_IRQLATENCY_DEFAULT << 0) /**< Shifted mode DEFAULT for MSC_IRQLATENCY */
 
+/* Bit fields for DMA CONFIG */
+#define DMA_CONFIG_EN                           (0x1UL << 0)                             /**< Enable DMA */
+
+/* Bit fields for DMA CH_CTRL */
+#define _DMA_CH_CTRL_SIGSEL_SHIFT               0                                        /**< Shift value for DMA_SIGSEL */
+#define _DMA_CH_CTRL_SIGSEL_MSCWDATA            0x00000000UL                             /**< Mode MSCWDATA for DMA_CH_CTRL */
+#define DMA_CH_CTRL_SIGSEL_MSCWDATA             (_DMA_CH_CTRL_SIGSEL_MSCWDATA << 0)      /**< Shifted mode MSCWDATA for DMA_CH_CTRL */
+#define _DMA_CH_CTRL_SOURCESEL_SHIFT            16                                       /**< Shift value for DMA_SOURCESEL */
+#define _DMA_CH_CTRL_SOURCESEL_MSC              0x00000030UL                             /**< Mode MSC for DMA_CH_CTRL */
+#define DMA_CH_CTRL_SOURCESEL_MSC               (_DMA_CH_CTRL_SOURCESEL_MSC << 16)       /**< Shifted mode MSC for DMA_CH_CTRL */
+
+/* Bit fields for the DMA descriptor CTRL word */
+#define _DMA_CTRL_CYCLE_CTRL_SHIFT              0                                        /**< Shift value for CYCLE_CTRL */
+#define DMA_CTRL_CYCLE_CTRL_BASIC               (0x1UL << 0)                             /**< Basic cycle type */
+#define _DMA_CTRL_N_MINUS_1_SHIFT               4                                        /**< Shift value for N_MINUS_1 */
+#define _DMA_CTRL_N_MINUS_1_MASK                0x3FF0UL                                 /**< Bit mask for N_MINUS_1 */
+#define _DMA_CTRL_R_POWER_SHIFT                 14                                       /**< Shift value for R_POWER */
+#define DMA_CTRL_R_POWER_1                      (0x0UL << 14)                            /**< Arbitrate after each transfer */
+#define DMA_CTRL_SRC_SIZE_WORD                  (0x2UL << 24)                            /**< Source data size is 32 bits */
+#define DMA_CTRL_SRC_INC_WORD                   (0x2UL << 26)                            /**< Source address increments by 4 */
+#define DMA_CTRL_DST_SIZE_WORD                  (0x2UL << 28)                            /**< Destination data size is 32 bits */
+#define DMA_CTRL_DST_INC_NONE                   (0x3UL << 30)                            /**< Destination address is fixed */
+
 /* Bit fields for GPIO P_CTRL */
 #define _GPIO_P_CTRL_RESETVALUE                           0x00000000UL                           /**< Default value for GPIO_P_CTRL */
 #define _GPIO_P_CTRL_MASK                                 0x00000003UL                           /**< Mask for GPIO_P_CTRL */
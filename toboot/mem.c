@@ -0,0 +1,140 @@
+#include "mem.h"
+
+// GCC would otherwise spot these loops and turn them into calls to the
+// functions they're part of.
+#define MEM_FUNC __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+// Copy whole words.  LDM and STM take one cycle per word plus one, where
+// a separate LDR and STR take two each.  tests/mem runs on the host, so
+// only the plain loop is tested there, not the LDM/STM one.
+MEM_FUNC static void copy_words(uint32_t *dst, const uint32_t *src, size_t count)
+{
+#if defined(__thumb__)
+    while (count >= 4) {
+        asm volatile("ldmia %1!, {r3, r4, r5, r6} \n\t"
+                     "stmia %0!, {r3, r4, r5, r6} \n\t"
+                     : "+l"(dst), "+l"(src)
+                     :
+                     : "r3", "r4", "r5", "r6", "memory");
+        count -= 4;
+    }
+#endif
+    while (count--)
+        *dst++ = *src++;
+}
+
+// Copy whole words from a source that isn't word-aligned, by reading
+// the aligned words around it and shifting each pair together.  Only
+// words that hold at least one of the source bytes get read.
+MEM_FUNC static void copy_words_shifted(uint32_t *dst, const uint8_t *src, size_t count)
+{
+    uint32_t shift = ((uintptr_t)src & 3) * 8;
+    const uint32_t *s = (const uint32_t *)((uintptr_t)src & ~3);
+    uint32_t lo = *s++;
+
+    while (count--) {
+        uint32_t hi = *s++;
+        *dst++ = (lo >> shift) | (hi << (32 - shift));
+        lo = hi;
+    }
+}
+
+MEM_FUNC void *memcpy(void *dst, const void *src, size_t cnt)
+{
+    uint8_t *dst8 = dst;
+    const uint8_t *src8 = src;
+
+    // Copy bytes until the destination is aligned, then as many whole
+    // words as there are, then whatever's left.
+    if (cnt >= 8) {
+        while ((uintptr_t)dst8 & 3) {
+            *dst8++ = *src8++;
+            cnt--;
+        }
+
+        if ((uintptr_t)src8 & 3)
+            copy_words_shifted((uint32_t *)dst8, src8, cnt / 4);
+        else
+            copy_words((uint32_t *)dst8, (const uint32_t *)src8, cnt / 4);
+        dst8 += cnt & ~3;
+        src8 += cnt & ~3;
+        cnt &= 3;
+    }
+
+    while (cnt--)
+        *dst8++ = *src8++;
+    return dst;
+}
+
+MEM_FUNC void *memset(void *dst, int c, size_t cnt)
+{
+    uint8_t *dst8 = dst;
+
+    if (cnt >= 8) {
+        uint32_t word = (uint8_t)c * 0x01010101UL;
+        uint32_t *dst32;
+
+        while ((uintptr_t)dst8 & 3) {
+            *dst8++ = c;
+            cnt--;
+        }
+
+        for (dst32 = (uint32_t *)dst8; cnt >= 4; cnt -= 4)
+            *dst32++ = word;
+        dst8 = (uint8_t *)dst32;
+    }
+
+    while (cnt--)
+        *dst8++ = c;
+    return dst;
+}
+
+MEM_FUNC int memcmp(const void *a, const void *b, size_t cnt)
+{
+    const uint8_t *a8 = a;
+    const uint8_t *b8 = b;
+
+    // Skip over matching words, if both sides can be read that way.  The
+    // bytes of the first word that differs are compared below, since
+    // the result depends on which byte comes first.
+    if (!(((uintptr_t)a8 | (uintptr_t)b8) & 3)) {
+        size_t same = mem_mismatch32(a, b, cnt / 4);
+        a8 += same * 4;
+        b8 += same * 4;
+        cnt -= same * 4;
+    }
+
+    while (cnt--) {
+        if (*a8 != *b8)
+            return *a8 - *b8;
+        a8++;
+        b8++;
+    }
+    return 0;
+}
+
+bool mem_is_blank(const void *p, size_t cnt)
+{
+    const uint32_t *p32 = p;
+
+    // Four words at a time, since this is mostly used on whole pages
+    for (; cnt >= 16; cnt -= 16, p32 += 4)
+        if ((p32[0] & p32[1] & p32[2] & p32[3]) != 0xffffffff)
+            return false;
+    for (; cnt >= 4; cnt -= 4)
+        if (*p32++ != 0xffffffff)
+            return false;
+    if (cnt && (*p32 | (0xffffffff << (cnt * 8))) != 0xffffffff)
+        return false;
+    return true;
+}
+
+size_t mem_mismatch32(const uint32_t *a, const uint32_t *b, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        if (a[i] != b[i])
+            break;
+    return i;
+}
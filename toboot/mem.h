@@ -0,0 +1,26 @@
+#ifndef TOBOOT_MEM_H_
+#define TOBOOT_MEM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Memory primitives for the Cortex-M0+.  There's no C library, and GCC
+// emits calls to memcpy() and memset() for struct copies and the like,
+// so these provide them.  Whenever both pointers share an alignment, they
+// work a word at a time, and four words at a time with LDM/STM where
+// they can.  The M0+ can't access unaligned words at all, so a copy from
+// an unaligned source assembles words by shifting instead.
+
+void *memcpy(void *dst, const void *src, size_t cnt);
+void *memset(void *dst, int c, size_t cnt);
+int memcmp(const void *a, const void *b, size_t cnt);
+
+// True if every byte is 0xff, as erased flash is.  p must be
+// word-aligned.
+bool mem_is_blank(const void *p, size_t cnt);
+
+// The index of the first word that differs, or count if none do.
+size_t mem_mismatch32(const uint32_t *a, const uint32_t *b, size_t count);
+
+#endif /* TOBOOT_MEM_H_ */
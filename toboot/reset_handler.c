@@ -12,8 +12,10 @@ extern uint32_t __main_stack_end__;
 /* Pointer to the Cortex vector table (located at offset 0) */
 extern uint32_t *_vectors;
 
-/* A place for the vector table to live while in RAM */
-static uint32_t ram_vectors[64] __attribute__ ((aligned (1024)));
+/* A place for the vector table to live while in RAM.  VTOR needs it
+   aligned to its own size, so the linker script puts it at the top of
+   RAM rather than leaving a hole in .bss. */
+static uint32_t ram_vectors[64] __attribute__ ((section(".ram_vectors"), aligned (256)));
 
 __attribute__ ((section(".startup")))
 void memcpy32(uint32_t *src, uint32_t *dest, uint32_t count) {
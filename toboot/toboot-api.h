@@ -72,6 +72,26 @@ struct toboot_configuration {
 #define TOBOOT_CONFIG_FAKE_SHIFT 2
 #define TOBOOT_CONFIG_FAKE (1 << 2)
 
+/// Set this flag to boot a new program on trial.  Until the program
+/// confirms that it works, by leaving TOBOOT_CONFIRM_MAGIC in the boot
+/// token, failing to boot three times in a row makes Toboot fall back
+/// to the previous program rather than enter the bootloader.  Toboot
+/// clears the flag in flash once the program has confirmed itself.
+///
+/// There's only a previous program to fall back to if it's still in
+/// flash, which means linking the two programs for different start
+/// addresses and loading them into separate slots.  If the new program
+/// was loaded over the old one, a failed trial enters the bootloader.
+///
+/// The header's hash is calculated with this bit masked out, so that
+/// clearing it doesn't invalidate the header.  That changes the V2 hash
+/// of any header with bit 3 set.  A program loaded by an earlier Toboot
+/// with that bit set won't pass the hash check any more, and has to be
+/// loaded again.
+#define TOBOOT_CONFIG_FLAG_CONFIRM_MASK   0x08
+#define TOBOOT_CONFIG_FLAG_CONFIRM_SHIFT  3
+#define TOBOOT_CONFIG_FLAG_CONFIRM        (1 << 3)
+
 /// Various magic values describing Toboot configuration headers.
 #define TOBOOT_V1_MAGIC         0x6fb0
 #define TOBOOT_V1_MAGIC_MASK    0x0000ffff
@@ -106,4 +126,8 @@ struct toboot_runtime {
 /// entry into Toboot.
 #define TOBOOT_FORCE_ENTRY_MAGIC    0x74624346
 
+/// A program booted on trial sets runtime.magic to this value once
+/// it's running properly.  Toboot takes note at the next reset.
+#define TOBOOT_CONFIRM_MAGIC        0x6b4f4254
+
 #endif /* TOBOOT_API_H_ */
\ No newline at end of file
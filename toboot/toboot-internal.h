@@ -41,6 +41,10 @@ extern enum bootloader_reason bootloader_reason;
 uint32_t tb_first_free_address(void);
 uint32_t tb_first_free_sector(void);
 const struct toboot_configuration *tb_get_config(void);
+const struct toboot_configuration *tb_get_previous_config(const struct toboot_configuration *cfg);
+void tb_write_word(uint32_t address, uint32_t value);
+void tb_confirm_config(const struct toboot_configuration *cfg);
+void tb_invalidate_config_at_page(uint32_t page);
 uint32_t tb_config_hash(const struct toboot_configuration *cfg);
 void tb_sign_config(struct toboot_configuration *cfg);
 uint32_t tb_generation(const struct toboot_configuration *cfg);
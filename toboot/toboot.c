@@ -1,5 +1,8 @@
 #include "toboot-api.h"
 #include "toboot-internal.h"
+#include "mcu.h"
+#include "dfu.h"
+#include "mem.h"
 
 #define XXH_NO_LONG_LONG
 #define XXH_FORCE_ALIGN_CHECK 0
@@ -22,8 +25,15 @@ uint32_t tb_first_free_address(void) {
 #undef PAGE_ROUND_UP
 }
 
+__attribute__ ((section(".startup")))
 uint32_t tb_config_hash(const struct toboot_configuration *cfg) {
-    return XXH32(cfg, sizeof(*cfg) - 4, TOBOOT_HASH_SEED);
+    struct toboot_configuration copy;
+
+    memcpy(&copy, cfg, sizeof(copy));
+    // Toboot clears this flag once the program confirms itself, which
+    // mustn't make the header invalid
+    copy.config &= ~TOBOOT_CONFIG_FLAG_CONFIRM;
+    return XXH32(&copy, sizeof(copy) - 4, TOBOOT_HASH_SEED);
 }
 
 void tb_sign_config(struct toboot_configuration *cfg) {
@@ -46,6 +56,7 @@ uint32_t tb_first_free_sector(void) {
     return tb_first_free_address() / 1024;
 }
 
+__attribute__ ((section(".startup")))
 const struct toboot_configuration *tb_get_config(void) {
     extern uint32_t __app_start__;
 
@@ -111,6 +122,103 @@ const struct toboot_configuration *tb_get_config(void) {
     return &fake_config;
 }
 
+// True if none of the vectors of the image whose header is at older
+// point at or past `page`.  Images are taken to run up to the next one,
+// but one that was really bigger than that lost its end to it.
+static int tb_vectors_below(const struct toboot_configuration *older, uint32_t page) {
+    const uint32_t *vectors = (const uint32_t *)(older->start * 1024);
+    uint32_t i;
+
+    for (i = 1; i < 0x94 / 4; i++)
+        if (vectors[i] >= page * 1024 && vectors[i] < 65536)
+            return 0;
+    return 1;
+}
+
+// Find the newest image that's older than cfg.  This is the one to fall
+// back to if cfg won't boot, so it must have survived cfg being loaded.
+// Loading invalidates any image whose pages it erases, and an image
+// after cfg's start would have lost its header.  That leaves an image
+// before cfg that really ran on into cfg's pages, which its vectors give
+// away.
+__attribute__ ((section(".startup")))
+const struct toboot_configuration *tb_get_previous_config(const struct toboot_configuration *cfg) {
+    const struct toboot_configuration *previous = NULL;
+    uint32_t page;
+
+    if (cfg->config & TOBOOT_CONFIG_FAKE)
+        return NULL;
+
+    for (page = 1; page < 65536/1024; page++) {
+        if (!tb_valid_signature_at_page(page)) {
+            const struct toboot_configuration *test_cfg = (const struct toboot_configuration *)((page * 1024) + 0x94);
+            if (test_cfg->reserved_gen >= cfg->reserved_gen)
+                continue;
+            if (test_cfg->start < cfg->start && !tb_vectors_below(test_cfg, cfg->start))
+                continue;
+            if (!previous || test_cfg->reserved_gen > previous->reserved_gen)
+                previous = test_cfg;
+        }
+    }
+
+    return previous;
+}
+
+// Write a single word of flash, leaving the rest of the page alone.  Bits
+// can be cleared without an erase, so this works on a word that's still
+// erased, or to clear more bits of one that has been written once.
+void tb_write_word(uint32_t address, uint32_t value) {
+    uint32_t locked = MSC->LOCK;
+    uint32_t writectrl = MSC->WRITECTRL;
+
+    // Flash is programmed using the AUXHFRCO
+    CMU->OSCENCMD = CMU_OSCENCMD_AUXHFRCOEN;
+    while (!(CMU->STATUS & CMU_STATUS_AUXHFRCORDY))
+        ;
+
+    MSC->LOCK = MSC_UNLOCK_CODE;
+    MSC->WRITECTRL = writectrl | MSC_WRITECTRL_WREN;
+    while (MSC->STATUS & MSC_STATUS_BUSY)
+        ;
+
+    MSC->ADDRB = address;
+    MSC->WRITECMD = MSC_WRITECMD_LADDRIM;
+    while (!(MSC->STATUS & MSC_STATUS_WDATAREADY))
+        ;
+    MSC->WDATA = value;
+    MSC->WRITECMD = MSC_WRITECMD_WRITEONCE;
+    while (MSC->STATUS & MSC_STATUS_BUSY)
+        ;
+
+    // Put the controller back the way the caller had it.  The write
+    // raises MSC_IF_WRITE, which nobody is waiting for.
+    MSC->IFC = MSC_IFC_WRITE;
+    MSC->WRITECTRL = writectrl;
+    if (locked)
+        MSC->LOCK = 0;
+}
+
+// The program at cfg has confirmed that it works, so it's no longer on
+// trial.  The flag is cleared by writing the header's second word again.
+__attribute__ ((section(".startup")))
+void tb_confirm_config(const struct toboot_configuration *cfg) {
+    const uint32_t *word = (const uint32_t *)cfg + 1;
+    uint32_t shift = 8 * (offsetof(struct toboot_configuration, config) - 4);
+
+    tb_write_word((uint32_t)word, *word & ~((uint32_t)TOBOOT_CONFIG_FLAG_CONFIRM << shift));
+}
+
+// Stop the image at this page from being booted, by clearing the magic
+// number in its header.
+void tb_invalidate_config_at_page(uint32_t page) {
+    const struct toboot_configuration *cfg = (const struct toboot_configuration *)((page * 1024) + 0x94);
+
+    tb_write_word((uint32_t)&cfg->magic, 0);
+
+    // The newest image may have just gone away
+    current_config = NULL;
+}
+
 uint32_t tb_generation(const struct toboot_configuration *cfg) {
     if (!cfg)
         return 0;
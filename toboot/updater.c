@@ -9,12 +9,19 @@ void updater(void) {
     usb_init();
     dfu_init();
 
-    while (dfu_getstate() != dfuMANIFEST_WAIT_RESET)
-        // Wait for firmware download
+    // Wait for firmware download.  The USB interrupt only queues up
+    // requests; they're handled here, along with the flash.
+    while (dfu_getstate() != dfuMANIFEST_WAIT_RESET) {
+        usb_poll();
+        dfu_poll();
         watchdog_refresh();
+    }
 
-    while (!fl_is_idle())
+    while (!fl_is_idle()) {
+        usb_poll();
+        dfu_poll();
         watchdog_refresh();
+    }
 
     // Let the watchdog reset the system
     while(1);
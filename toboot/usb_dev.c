@@ -32,6 +32,7 @@
  */
 
 #include "mcu.h"
+#include "mem.h"
 #include "usb_dev.h"
 #include "usb_desc.h"
 #include "dfu.h"
@@ -41,12 +42,10 @@
 
 static uint8_t usb_configuration = 0;
 
-void *memcpy(void *dst, const void *src, size_t cnt);
 static uint32_t ep0_rx_offset;
 
 static struct device_req ep0_setup_pkt[3] __attribute__((aligned(4)));
 static char ctrl_send_buf[USB_MAX_PACKET_SIZE] __attribute__((aligned(4)));
-static uint8_t rx_buffer[USB_MAX_PACKET_SIZE];
 
 /* The state machine states of a control pipe */
 enum CONTROL_STATE
@@ -64,6 +63,7 @@ struct ctrl_data
 {
     uint8_t *addr;
     uint16_t len;
+    uint16_t pkt_len;       /* Size of the OUT packet being received */
     uint8_t require_zlp;
 };
 
@@ -79,6 +79,23 @@ static struct device_req last_setup;
 struct usb_dev *dev = &default_dev;
 static uint8_t reply_buffer[8];
 
+/*
+ * Work for the main loop.  USB_Handler() only takes packets off the bus:
+ * anything that needs dfu.c is left here for usb_poll(), and the endpoint
+ * it came in on NAKs until then.
+ *
+ * At most one request, and one data stage packet for it, can be waiting.
+ * A new SETUP or a bus reset means the host has given up on whatever
+ * request came before, so it replaces anything still waiting.  And the
+ * next data stage packet isn't asked for until usb_poll() has dealt with
+ * the last one.
+ * usb_poll() runs with the USB interrupt masked, so none of this changes
+ * while it's being read.
+ */
+static struct device_req pending_req;   /* Class or vendor request to one of our interfaces */
+static volatile bool pending_setup;     /* Set if pending_req is waiting to be run */
+static volatile bool pending_ep0_out;   /* Set if a data stage packet for it is waiting */
+
 static void efm32hg_connect(void)
 {
     USB->DCTL &= ~(DCTL_WO_BITMASK | USB_DCTL_SFTDISCON);
@@ -130,28 +147,38 @@ efm32hg_ep0_in_stall(void)
     USB_DINEPS[0].CTL = ctl;
 }
 
-static void handle_datastage_out(struct usb_dev *dev)
+/* Ask for the next packet of the data stage */
+static void efm32hg_ep0_out_next(struct usb_dev *dev)
 {
     struct ctrl_data *data_p = &dev->ctrl_data;
-    uint32_t len = USB->DOEP0TSIZ & 0x7FUL; /* XFERSIZE */
     uint32_t pktsize = 64;
+    uint32_t len = data_p->len < pktsize ? data_p->len : pktsize;
+
+    dev->state = OUT_DATA;
+    data_p->pkt_len = len;
+    efm32hg_prepare_ep0_out(data_p->addr, len);
+}
+
+/*
+ * Returns the size of the packet that was just received.  Once the last
+ * one is in, the request's handler acknowledges the transfer (or stalls
+ * it).  A short packet means the host has ended the data stage early.
+ */
+static uint32_t handle_datastage_out(struct usb_dev *dev)
+{
+    struct ctrl_data *data_p = &dev->ctrl_data;
+    uint32_t len = data_p->pkt_len - (USB->DOEP0TSIZ & 0x7FUL); /* XFERSIZE left */
+    uint32_t received = len;
 
     data_p->len -= len;
     data_p->addr += len;
+    if (len < data_p->pkt_len)
+        data_p->len = 0;
 
-    if (data_p->len == 0)
-    {
-        /* No more data to receive, proceed to send acknowledge for IN.  */
-        efm32hg_prepare_ep0_setup();
-        dev->state = WAIT_STATUS_IN;
-        efm32hg_prepare_ep0_in(NULL, 0);
-    }
-    else
-    {
-        len = data_p->len < pktsize ? data_p->len : pktsize;
-        dev->state = OUT_DATA;
-        efm32hg_prepare_ep0_out(data_p->addr, len);
-    }
+    if (data_p->len != 0)
+        efm32hg_ep0_out_next(dev);
+
+    return received;
 }
 
 static void handle_datastage_in(struct usb_dev *dev)
@@ -199,6 +226,7 @@ void usb_lld_ctrl_recv(struct usb_dev *dev, void *p, size_t len)
     if (len > pktsize)
         len = pktsize;
 
+    data_p->pkt_len = len;
     efm32hg_prepare_ep0_out(p, len);
     dev->state = OUT_DATA;
 }
@@ -217,6 +245,7 @@ static void usb_lld_ctrl_ack(struct usb_dev *dev)
  *
  * BUFLEN: size of the data.
  */
+__attribute__ ((section(".startup")))
 void usb_lld_ctrl_send(struct usb_dev *dev, const void *buf, size_t buflen)
 {
     struct ctrl_data *data_p = &dev->ctrl_data;
@@ -231,7 +260,10 @@ void usb_lld_ctrl_send(struct usb_dev *dev, const void *buf, size_t buflen)
     if (data_p->len > len_asked)
         data_p->len = len_asked;
 
-    data_p->require_zlp = (data_p->len != 0 && (data_p->len & (pktsize - 1)) == 0);
+    // A short transfer that ends on a packet boundary needs a ZLP to
+    // tell the host it's over.  One that's as long as requested doesn't.
+    data_p->require_zlp = (data_p->len != 0 && data_p->len < len_asked
+                           && (data_p->len & (pktsize - 1)) == 0);
 
     if (((uint32_t)data_p->addr & 3) && (data_p->len <= pktsize))
     {
@@ -264,14 +296,27 @@ static void usb_lld_ctrl_error(struct usb_dev *dev)
     efm32hg_prepare_ep0_setup();
 }
 
+static void usb_mask(void)
+{
+    NVIC_DisableIRQ(USB_IRQn);
+    asm volatile ("" : : : "memory");
+}
+
+static void usb_unmask(void)
+{
+    asm volatile ("" : : : "memory");
+    NVIC_EnableIRQ(USB_IRQn);
+}
+
 static void handle_out0(struct usb_dev *dev)
 {
     if (dev->state == OUT_DATA)
     {
         /* It's normal control WRITE transfer.  */
-        handle_datastage_out(dev);
+        uint32_t size = handle_datastage_out(dev);
 
-        // The only control OUT request we have now, DFU_DNLOAD
+        // The only control OUT request we have, DFU_DNLOAD.  size is
+        // what the host sent in this packet.
         if (last_setup.wRequestAndType == 0x0121)
         {
             if (last_setup.wIndex != 0 && ep0_rx_offset > last_setup.wLength)
@@ -280,15 +325,11 @@ static void handle_out0(struct usb_dev *dev)
             }
             else
             {
-                uint32_t size = last_setup.wLength - ep0_rx_offset;
-                if (size > EP0_SIZE)
-                    size = EP0_SIZE;
-
+                // The packet has already landed in the block buffer
                 if (dfu_download(last_setup.wValue,  // blockNum
                                  last_setup.wLength, // blockLength
                                  ep0_rx_offset,      // packetOffset
-                                 size,               // packetLength
-                                 rx_buffer))
+                                 size))              // packetLength
                 {
                     ep0_rx_offset += size;
                     if (ep0_rx_offset >= last_setup.wLength)
@@ -296,6 +337,11 @@ static void handle_out0(struct usb_dev *dev)
                         // End of transaction, acknowledge with a zero-length IN
                         usb_lld_ctrl_ack(dev);
                     }
+                    else if (dev->ctrl_data.len == 0)
+                    {
+                        // The host ended the data stage early
+                        usb_lld_ctrl_error(dev);
+                    }
                 }
                 else
                 {
@@ -326,11 +372,18 @@ static void handle_out0(struct usb_dev *dev)
     }
 }
 
+/*
+ * Like USB_Handler(), this runs straight from flash to leave RAM for the
+ * DFU block buffers.  It stalls while the flash controller is busy, but
+ * works all the same.
+ */
+__attribute__ ((section(".startup")))
 static void usb_setup(struct usb_dev *dev)
 {
     const uint8_t *data = NULL;
     uint32_t datalen = 0;
     const usb_descriptor_list_t *list;
+    uint8_t *dest;
     last_setup = dev->dev_req;
 
     switch (dev->dev_req.wRequestAndType)
@@ -438,6 +491,16 @@ static void usb_setup(struct usb_dev *dev)
         usb_lld_ctrl_error(dev);
         return;
 
+    case (DFU_VENDOR_GET_STATS << 8) | 0xC1: // Get download statistics
+        if (dev->dev_req.wIndex != DFU_INTERFACE)
+        {
+            usb_lld_ctrl_error(dev);
+            return;
+        }
+        data = (const uint8_t *)dfu_getstats();
+        datalen = sizeof(struct dfu_stats);
+        break;
+
     case 0x0121: // DFU_DNLOAD
         if (dev->dev_req.wIndex > 0)
         {
@@ -447,7 +510,7 @@ static void usb_setup(struct usb_dev *dev)
         // Data comes in the OUT phase. But if it's a zero-length request, handle it now.
         if (dev->dev_req.wLength == 0)
         {
-            if (!dfu_download(dev->dev_req.wValue, 0, 0, 0, NULL))
+            if (!dfu_download(dev->dev_req.wValue, 0, 0, 0))
             {
                 usb_lld_ctrl_error(dev);
                 return;
@@ -455,10 +518,17 @@ static void usb_setup(struct usb_dev *dev)
             usb_lld_ctrl_ack(dev);
             return;
         }
-        unsigned int len = dev->dev_req.wLength;
-        if (len > sizeof(rx_buffer))
-            len = sizeof(rx_buffer);
-        usb_lld_ctrl_recv(dev, rx_buffer, len);
+        // Receive the block straight into the buffer it'll be programmed
+        // from.  If dfu.c can't take it, stall now rather than after the
+        // host has sent it all.
+        ep0_rx_offset = 0;
+        dest = dfu_download_buffer(dev->dev_req.wValue, dev->dev_req.wLength);
+        if (!dest)
+        {
+            usb_lld_ctrl_error(dev);
+            return;
+        }
+        usb_lld_ctrl_recv(dev, dest, dev->dev_req.wLength);
         return;
 
     case 0x03a1: // DFU_GETSTATUS
@@ -557,6 +627,54 @@ static void handle_in0(struct usb_dev *dev)
     }
 }
 
+/*
+ * Class and vendor requests to our interfaces are nearly all for dfu.c,
+ * which can take a while over them, so they're left to usb_poll().
+ * Standard requests are quick, and answered straight away.
+ */
+__attribute__ ((section(".startup")))
+static void handle_setup(struct usb_dev *dev)
+{
+    pending_setup = false;
+    pending_ep0_out = false;
+    if ((dev->dev_req.bmRequestType & 0x1f) == 0x01     /* Interface */
+     && (dev->dev_req.bmRequestType & 0x60) != 0x00)    /* Class or vendor */
+    {
+        pending_req = dev->dev_req;
+        pending_setup = true;
+    }
+    else
+    {
+        usb_setup(dev);
+    }
+}
+
+/*
+ * Run whatever USB_Handler() has queued up.  Called from the main loop.
+ * The USB interrupt is held off meanwhile, as these share the control
+ * pipe with it.  The flash controller isn't waited on here: that's
+ * dfu_poll()'s job, which runs with interrupts enabled.
+ */
+void usb_poll(void)
+{
+    usb_mask();
+
+    /* The request comes first, as it's what asks for its data stage */
+    if (pending_setup)
+    {
+        pending_setup = false;
+        dev->dev_req = pending_req;
+        usb_setup(dev);
+    }
+    if (pending_ep0_out)
+    {
+        pending_ep0_out = false;
+        handle_out0(dev);
+    }
+
+    usb_unmask();
+}
+
 __attribute__ ((section(".startup")))
 void USB_Handler(void)
 {
@@ -566,6 +684,8 @@ void USB_Handler(void)
     {
         USB->GINTSTS = USB_GINTSTS_USBRST;
         efm32hg_set_daddr(0);
+        pending_setup = false;
+        pending_ep0_out = false;
         return;
     }
 
@@ -608,10 +728,12 @@ void USB_Handler(void)
                 int supcnt = (USB->DOEP0TSIZ & 0x60000000UL) >> 29;
                 supcnt = (supcnt == 3) ? 2 : supcnt;
                 dev->dev_req = ep0_setup_pkt[2 - supcnt];
-                usb_setup(dev);
+                handle_setup(dev);
             }
             else if (dev->state == WAIT_STATUS_IN)
                 dev->state = WAIT_SETUP;
+            else if (dev->state == OUT_DATA)
+                pending_ep0_out = true;
             else if (dev->state != WAIT_SETUP)
                 handle_out0(dev);
         }
@@ -623,7 +745,7 @@ void USB_Handler(void)
                 int supcnt = (USB->DOEP0TSIZ & 0x60000000UL) >> 29;
                 supcnt = (supcnt == 3) ? 2 : supcnt;
                 dev->dev_req = ep0_setup_pkt[2 - supcnt];
-                usb_setup(dev);
+                handle_setup(dev);
             }
         }
 
@@ -683,6 +805,7 @@ static int usb_core_init(void)
     return 0;
 }
 
+__attribute__ ((section(".startup")))
 void usb_init(void)
 {
     // Follow section 14.3.2 USB Initialization, EFM32HG-RM.pdf
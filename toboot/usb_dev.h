@@ -38,6 +38,7 @@ extern "C" {
 #endif
 
 void usb_init(void);
+void usb_poll(void);
 
 #ifdef __cplusplus
 }